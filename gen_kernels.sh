@@ -0,0 +1,33 @@
+#!/bin/sh
+# Generate vector_ops_ocl_spv.h, the kernels embedded in opencl_matrix_add.cpp:
+# the SPIR-V compiled from vector_ops_ocl.cl (when clang and llvm-spirv are on
+# the PATH) and the source itself. Run it again after editing the kernels.
+#
+#   ./gen_kernels.sh && g++ -O2 opencl_matrix_add.cpp -lOpenCL -pthread
+set -e
+cd "$(dirname "$0")"
+
+CLANG=${CLANG:-clang}
+LLVM_SPIRV=${LLVM_SPIRV:-llvm-spirv}
+out=vector_ops_ocl_spv.h
+
+if ! command -v xxd >/dev/null 2>&1; then
+    echo "xxd not found, cannot embed the kernels" >&2
+    exit 1
+fi
+
+# xxd names the arrays after the file names, so run it next to the sources
+echo "// Generated by gen_kernels.sh from vector_ops_ocl.cl, do not edit" > $out.tmp
+if command -v "$CLANG" >/dev/null 2>&1 && command -v "$LLVM_SPIRV" >/dev/null 2>&1; then
+    "$CLANG" -c -cl-std=CL2.0 -target spir64 -Xclang -finclude-default-header \
+        -emit-llvm -O2 -o vector_ops_ocl.bc vector_ops_ocl.cl
+    "$LLVM_SPIRV" vector_ops_ocl.bc -o vector_ops_ocl.spv
+    xxd -i vector_ops_ocl.spv >> $out.tmp
+    echo "#define HAVE_EMBEDDED_SPIRV 1" >> $out.tmp
+    rm -f vector_ops_ocl.bc
+    echo "Embedded SPIR-V and source in $out"
+else
+    echo "$CLANG or $LLVM_SPIRV not found: embedding the kernel source only" >&2
+fi
+xxd -i vector_ops_ocl.cl >> $out.tmp
+mv $out.tmp $out
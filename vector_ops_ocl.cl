@@ -1,12 +1,712 @@
-__kernel void vector_add_ocl(const int size, __global int *v1, __global int *v2, __global int *v_out) {
-
-    
-    const int globalIndex = get_global_id(0);
-
-  
-    if (globalIndex < size) {
-
-        
-        v_out[globalIndex] = v1[globalIndex] + v2[globalIndex];
-    }
-}
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+
+__kernel void vector_add_ocl(const int size, __global int *v1, __global int *v2, __global int *v_out) {
+
+#ifdef SPEC_SIZE
+    // Size-specialized build (-DSPEC_SIZE/-DSPEC_WIDTH/...): each work item adds
+    // SPEC_WIDTH consecutive elements and size is a compile-time constant
+#if SPEC_ALIGNED
+    // Exact split on aligned buffers: one native vector load/store per input
+    typedef CAT(int, SPEC_WIDTH) intN;
+    const int vectorIndex = get_global_id(0);
+    ((__global intN *)v_out)[vectorIndex] = ((__global intN *)v1)[vectorIndex] + ((__global intN *)v2)[vectorIndex];
+#elif SPEC_EXACT
+    // Exact split: no bounds check, statically bounded loop
+    const int base = get_global_id(0) * SPEC_WIDTH;
+    #pragma unroll
+    for (int k = 0; k < SPEC_WIDTH; k++) {
+        v_out[base + k] = v1[base + k] + v2[base + k];
+    }
+#else
+    // Only the last work item can run past SPEC_SIZE
+    const int base = get_global_id(0) * SPEC_WIDTH;
+    #pragma unroll
+    for (int k = 0; k < SPEC_WIDTH; k++) {
+        if (base + k < SPEC_SIZE) {
+            v_out[base + k] = v1[base + k] + v2[base + k];
+        }
+    }
+#endif
+
+#else
+    
+    const int globalIndex = get_global_id(0);
+
+  
+    if (globalIndex < size) {
+
+        
+        v_out[globalIndex] = v1[globalIndex] + v2[globalIndex];
+    }
+#endif
+}
+
+// Counter-based generator: hashes (seed, stream, index) so every element can be
+// produced independently. rng_value() in opencl_matrix_add.cpp mirrors it bit for bit.
+uint rng_hash(const uint seed, const uint stream, const uint index) {
+
+    uint x = index + seed * 0x9E3779B9u + stream * 0x632BE5ABu;
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// first is the index of v[0] in the whole vector, so a chunk of it can be
+// generated on its own
+__kernel void fill_random_ocl(const int size, const uint seed, const uint stream, __global int *v, const int first) {
+
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex < size) {
+
+        // Same 0-99 range as init() on the host
+        v[globalIndex] = (int)(rng_hash(seed, stream, (uint)(first + globalIndex)) % 100u);
+    }
+}
+
+// Deterministic input patterns (fill_value() in opencl_matrix_add.cpp mirrors
+// them): mode 2 is the ramp a + i * b, mode 3 puts b at every a-th element.
+// stream shifts them so the inputs differ: it is added to the ramp and moves
+// the strided positions
+__kernel void fill_pattern_ocl(const int size, const int first, const uint stream, const int mode, const int a, const int b, __global int *v) {
+
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex < size) {
+
+        const uint i = (uint)(first + globalIndex);
+        v[globalIndex] = mode == 2 ? (int)((uint)a + stream + i * (uint)b) : ((i + stream) % (uint)a == 0 ? b : 0);
+    }
+}
+
+// Prefix sums, instantiated for int and float below. Each work-group scans one
+// block of 2 * local size elements in local memory with the work-efficient
+// (Blelloch) up-sweep / down-sweep and writes its block total; the host scans
+// the block totals the same way (recursively) and adds them back, so any n
+// works. inclusive: 0 = out[i] excludes in[i], 1 = includes it.
+#define DEFINE_SCAN(T) \
+__kernel void scan_blocks_##T(const int n, const int inclusive, __global const T *in, __global T *out, __global T *block_sums, __local T *tmp) { \
+\
+    const int lid = get_local_id(0); \
+    const int block = 2 * get_local_size(0); \
+    const int base = get_group_id(0) * block; \
+\
+    const T x0 = base + 2 * lid < n ? in[base + 2 * lid] : 0; \
+    const T x1 = base + 2 * lid + 1 < n ? in[base + 2 * lid + 1] : 0; \
+    tmp[2 * lid] = x0; \
+    tmp[2 * lid + 1] = x1; \
+\
+    /* Up-sweep: build partial sums in place */ \
+    int offset = 1; \
+    for (int d = block >> 1; d > 0; d >>= 1) { \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+        if (lid < d) { \
+            const int ai = offset * (2 * lid + 1) - 1; \
+            const int bi = offset * (2 * lid + 2) - 1; \
+            tmp[bi] += tmp[ai]; \
+        } \
+        offset <<= 1; \
+    } \
+\
+    if (lid == 0) { \
+        block_sums[get_group_id(0)] = tmp[block - 1]; \
+        tmp[block - 1] = 0; \
+    } \
+\
+    /* Down-sweep: distribute the partial sums */ \
+    for (int d = 1; d < block; d <<= 1) { \
+        offset >>= 1; \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+        if (lid < d) { \
+            const int ai = offset * (2 * lid + 1) - 1; \
+            const int bi = offset * (2 * lid + 2) - 1; \
+            const T t = tmp[ai]; \
+            tmp[ai] = tmp[bi]; \
+            tmp[bi] += t; \
+        } \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+\
+    if (base + 2 * lid < n) { \
+        out[base + 2 * lid] = inclusive ? tmp[2 * lid] + x0 : tmp[2 * lid]; \
+    } \
+    if (base + 2 * lid + 1 < n) { \
+        out[base + 2 * lid + 1] = inclusive ? tmp[2 * lid + 1] + x1 : tmp[2 * lid + 1]; \
+    } \
+} \
+\
+/* Adds the scanned block totals back onto every element of their block */ \
+__kernel void scan_add_offsets_##T(const int n, const int block, __global T *out, __global const T *block_offsets) { \
+\
+    const int globalIndex = get_global_id(0); \
+\
+    if (globalIndex < n) { \
+        out[globalIndex] += block_offsets[globalIndex / block]; \
+    } \
+}
+
+// Segmented prefix sums: a nonzero flag starts a new segment. The same
+// Blelloch sweeps run on (flag, value) pairs with the associative operator
+// (f1, v1) + (f2, v2) = (f1 | f2, f2 ? v2 : v1 + v2). mode: 0 = exclusive
+// (0 at each segment head), 1 = inclusive, 2 = exclusive carry (the head keeps
+// the sum before it; used for the block totals of the level below). Each block
+// also reports whether it holds a head and where the first one is, which tells
+// the add-back which elements the carry from earlier blocks reaches.
+#define DEFINE_SEGMENTED_SCAN(T) \
+__kernel void seg_scan_blocks_##T(const int n, const int mode, __global const int *flags, __global const T *in, __global T *out, __global T *block_sums, __global int *block_flags, __global int *block_first, __local T *tmp, __local int *tmp_flags) { \
+\
+    const int lid = get_local_id(0); \
+    const int block = 2 * get_local_size(0); \
+    const int base = get_group_id(0) * block; \
+\
+    T x[2]; \
+    int f[2]; \
+    for (int k = 0; k < 2; k++) { \
+        const int i = base + 2 * lid + k; \
+        x[k] = i < n ? in[i] : 0; \
+        f[k] = i < n ? flags[i] != 0 : 0; \
+        tmp[2 * lid + k] = x[k]; \
+        tmp_flags[2 * lid + k] = f[k]; \
+    } \
+\
+    /* Up-sweep: right = left + right under the pair operator */ \
+    int offset = 1; \
+    for (int d = block >> 1; d > 0; d >>= 1) { \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+        if (lid < d) { \
+            const int ai = offset * (2 * lid + 1) - 1; \
+            const int bi = offset * (2 * lid + 2) - 1; \
+            if (!tmp_flags[bi]) { \
+                tmp[bi] += tmp[ai]; \
+            } \
+            tmp_flags[bi] |= tmp_flags[ai]; \
+        } \
+        offset <<= 1; \
+    } \
+\
+    if (lid == 0) { \
+        block_sums[get_group_id(0)] = tmp[block - 1]; \
+        block_flags[get_group_id(0)] = tmp_flags[block - 1]; \
+        tmp[block - 1] = 0; \
+        tmp_flags[block - 1] = 0; \
+    } \
+\
+    /* Down-sweep: left gets the prefix, right gets prefix + left subtree */ \
+    for (int d = 1; d < block; d <<= 1) { \
+        offset >>= 1; \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+        if (lid < d) { \
+            const int ai = offset * (2 * lid + 1) - 1; \
+            const int bi = offset * (2 * lid + 2) - 1; \
+            const T t = tmp[ai]; \
+            const int tf = tmp_flags[ai]; \
+            tmp[ai] = tmp[bi]; \
+            tmp_flags[ai] = tmp_flags[bi]; \
+            tmp[bi] = tf ? t : tmp[bi] + t; \
+            tmp_flags[bi] |= tf; \
+        } \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+\
+    for (int k = 0; k < 2; k++) { \
+        const int i = base + 2 * lid + k; \
+        if (i < n) { \
+            const T prefix = tmp[2 * lid + k]; \
+            out[i] = mode == 1 ? (f[k] ? x[k] : prefix + x[k]) : (mode == 0 && f[k] ? 0 : prefix); \
+            /* Only the first head of the block has no head before it */ \
+            if (f[k] && !tmp_flags[2 * lid + k]) { \
+                block_first[get_group_id(0)] = i; \
+            } \
+        } \
+    } \
+} \
+\
+/* Adds the scanned block totals to the elements no head of their own block shields */ \
+__kernel void seg_scan_add_offsets_##T(const int n, const int block, const int mode, __global T *out, __global const T *block_offsets, __global const int *block_flags, __global const int *block_first) { \
+\
+    const int globalIndex = get_global_id(0); \
+\
+    if (globalIndex < n) { \
+        const int g = globalIndex / block; \
+        const int first = block_flags[g] ? block_first[g] : n; \
+        /* A carry scan still adds across the head itself */ \
+        if (globalIndex < first || (mode == 2 && globalIndex == first)) { \
+            out[globalIndex] += block_offsets[g]; \
+        } \
+    } \
+}
+
+DEFINE_SCAN(int)
+DEFINE_SCAN(float)
+DEFINE_SEGMENTED_SCAN(int)
+DEFINE_SEGMENTED_SCAN(float)
+
+// Sparse addition on CSR operands (a sparse vector is a CSR matrix with one row).
+// Every entry of A and B gets a slot in the row-wise merge of both index sets:
+// A entry i lands at i + (B entries of its row with a smaller column), B entry j
+// at j + (A entries of its row with a smaller or equal column). Equal columns
+// are summed into the A slot and the B slot is flagged for removal; a scan of
+// the keep flags then gives each surviving slot its compacted position.
+
+// Largest r with row_ptr[r] <= entry (the row that owns a CSR entry)
+int csr_row_of(__global const int *row_ptr, const int rows, const int entry) {
+
+    int lo = 0, hi = rows - 1;
+    while (lo < hi) {
+        const int mid = (lo + hi + 1) >> 1;
+        if (row_ptr[mid] <= entry) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// First position in col[lo, hi) whose column is >= key (or > key when upper)
+int csr_bound(__global const int *col, int lo, int hi, const int key, const int upper) {
+
+    while (lo < hi) {
+        const int mid = (lo + hi) >> 1;
+        if (col[mid] < key || (upper && col[mid] == key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+__kernel void csr_merge_a(const int rows, const int nnz_a, __global const int *row_ptr_a, __global const int *col_a, __global const int *val_a, __global const int *row_ptr_b, __global const int *col_b, __global const int *val_b, __global int *merged_row, __global int *merged_col, __global int *merged_val, __global int *keep) {
+
+    const int i = get_global_id(0);
+
+    if (i < nnz_a) {
+        const int r = csr_row_of(row_ptr_a, rows, i);
+        const int b_end = row_ptr_b[r + 1];
+        const int lb = csr_bound(col_b, row_ptr_b[r], b_end, col_a[i], 0);
+        const int slot = i + lb;
+
+        int v = val_a[i];
+        if (lb < b_end && col_b[lb] == col_a[i]) {
+            v += val_b[lb]; // Shared index: A's slot carries the sum
+        }
+
+        merged_row[slot] = r;
+        merged_col[slot] = col_a[i];
+        merged_val[slot] = v;
+        keep[slot] = 1;
+    }
+}
+
+__kernel void csr_merge_b(const int rows, const int nnz_b, __global const int *row_ptr_a, __global const int *col_a, __global const int *row_ptr_b, __global const int *col_b, __global const int *val_b, __global int *merged_row, __global int *merged_col, __global int *merged_val, __global int *keep) {
+
+    const int j = get_global_id(0);
+
+    if (j < nnz_b) {
+        const int r = csr_row_of(row_ptr_b, rows, j);
+        const int a_start = row_ptr_a[r];
+        const int ub = csr_bound(col_a, a_start, row_ptr_a[r + 1], col_b[j], 1);
+        const int slot = j + ub;
+
+        merged_row[slot] = r;
+        merged_col[slot] = col_b[j];
+        merged_val[slot] = val_b[j];
+        keep[slot] = !(ub > a_start && col_a[ub - 1] == col_b[j]);
+    }
+}
+
+// Moves kept slots to their scanned positions; out_row may be the COO row array
+__kernel void csr_compact(const int total, const int with_rows, __global const int *keep, __global const int *offsets, __global const int *merged_row, __global const int *merged_col, __global const int *merged_val, __global int *out_row, __global int *out_col, __global int *out_val) {
+
+    const int k = get_global_id(0);
+
+    if (k < total && keep[k]) {
+        const int dst = offsets[k];
+        out_col[dst] = merged_col[k];
+        out_val[dst] = merged_val[k];
+        if (with_rows) {
+            out_row[dst] = merged_row[k];
+        }
+    }
+}
+
+// Row r of the result starts at the scanned position of its first merge slot
+__kernel void csr_result_row_ptr(const int rows, __global const int *row_ptr_a, __global const int *row_ptr_b, __global const int *offsets, __global int *out_row_ptr) {
+
+    const int r = get_global_id(0);
+
+    if (r <= rows) {
+        out_row_ptr[r] = offsets[row_ptr_a[r] + row_ptr_b[r]];
+    }
+}
+
+// dense[row, col] += value for every entry; indices are unique per operand
+__kernel void csr_scatter_dense(const int rows, const int cols, const int nnz, __global const int *row_ptr, __global const int *col, __global const int *val, __global int *dense) {
+
+    const int i = get_global_id(0);
+
+    if (i < nnz) {
+        const long pos = (long)csr_row_of(row_ptr, rows, i) * cols + col[i];
+        dense[pos] += val[i];
+    }
+}
+
+// Transfer codec: vectors travel as frame-of-reference offsets (value - base)
+// of 1, 2 or 4 bytes and are widened here, fused with the add. The width is
+// the same for every work item, so the branches do not diverge.
+int codec_load(__global const uchar *p, const int width, const int i) {
+
+    if (width == 1) {
+        return p[i];
+    }
+    if (width == 2) {
+        return ((__global const ushort *)p)[i];
+    }
+    return ((__global const int *)p)[i];
+}
+
+void codec_store(__global uchar *p, const int width, const int i, const int v) {
+
+    if (width == 1) {
+        p[i] = (uchar)v;
+    } else if (width == 2) {
+        ((__global ushort *)p)[i] = (ushort)v;
+    } else {
+        ((__global int *)p)[i] = v;
+    }
+}
+
+__kernel void vector_add_codec_ocl(const int size, __global const uchar *v1, __global const uchar *v2, __global uchar *v_out, const int width1, const int base1, const int width2, const int base2, const int width_out, const int base_out) {
+
+    const int globalIndex = get_global_id(0);
+
+    if (globalIndex < size) {
+
+        const int sum = codec_load(v1, width1, globalIndex) + base1 + codec_load(v2, width2, globalIndex) + base2;
+
+        // The result is narrowed again when its range allows
+        codec_store(v_out, width_out, globalIndex, sum - base_out);
+    }
+}
+
+// Histogram of int values in the inclusive range [lo, hi] split into bins equal
+// bins; values outside the range are not counted. Every work-group counts into
+// private bins in local memory (cheap local atomics) and merges them into the
+// global histogram with one global atomic per non-empty bin.
+
+// Bin of a value, or -1 outside [lo, hi]
+int hist_bin(const int v, const int lo, const int hi, const int bins) {
+
+    if (v < lo || v > hi) {
+        return -1;
+    }
+    return (int)(((long)v - lo) * bins / ((long)hi - lo + 1));
+}
+
+// Clears the work-group's private bins
+void hist_clear(__local uint *local_bins, const int bins) {
+
+    for (int b = get_local_id(0); b < bins; b += get_local_size(0)) {
+        local_bins[b] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Merges the work-group's private bins into the global histogram
+void hist_merge(__local uint *local_bins, const int bins, __global uint *hist) {
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int b = get_local_id(0); b < bins; b += get_local_size(0)) {
+        const uint count = local_bins[b];
+        if (count != 0) {
+            atomic_add(&hist[b], count);
+        }
+    }
+}
+
+// Grid-stride loop, so a few work-groups per compute unit cover any size
+__kernel void histogram_ocl(const int size, const int lo, const int hi, const int bins, __global const int *in, __global uint *hist, __local uint *local_bins) {
+
+    hist_clear(local_bins, bins);
+    for (int i = get_global_id(0); i < size; i += get_global_size(0)) {
+        const int b = hist_bin(in[i], lo, hi, bins);
+        if (b >= 0) {
+            atomic_inc(&local_bins[b]);
+        }
+    }
+    hist_merge(local_bins, bins, hist);
+}
+
+// vector_add_ocl fused with histogram_ocl: each sum is binned while it is
+// still in a register, so v_out is never read back for the histogram
+__kernel void vector_add_histogram_ocl(const int size, __global int *v1, __global int *v2, __global int *v_out, const int lo, const int hi, const int bins, __global uint *hist, __local uint *local_bins) {
+
+    hist_clear(local_bins, bins);
+    for (int i = get_global_id(0); i < size; i += get_global_size(0)) {
+        const int sum = v1[i] + v2[i];
+        v_out[i] = sum;
+        const int b = hist_bin(sum, lo, hi, bins);
+        if (b >= 0) {
+            atomic_inc(&local_bins[b]);
+        }
+    }
+    hist_merge(local_bins, bins, hist);
+}
+
+// LSD radix sort, RADIX_BITS per pass. Keys are mapped onto unsigned integers
+// whose order matches the key order, and each pass is three steps:
+//   radix_count:   per work-group digit histogram (local atomics), stored
+//                  digit-major so one exclusive scan of all counts gives every
+//                  (digit, group) its first output position
+//   scan_blocks:   the exclusive scan of the counts (host side scan_device)
+//   radix_scatter: each work-group stably sorts its tile by the digit in
+//                  local memory (RADIX_BITS one-bit splits) and writes every
+//                  key (and value) to its scanned offset plus its rank
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Order-preserving maps of the key types onto unsigned integers: flip the
+// sign bit of integers; flip all bits of negative floats, the sign of others
+uint radix_map_int(const int x) {
+    return (uint)x ^ 0x80000000u;
+}
+uint radix_map_float(const float x) {
+    const uint u = as_uint(x);
+    return u ^ ((u >> 31) ? 0xFFFFFFFFu : 0x80000000u);
+}
+ulong radix_map_long(const long x) {
+    return (ulong)x ^ 0x8000000000000000ul;
+}
+
+// Exclusive scan of one int per work item in local memory; total receives the
+// sum over the work-group
+int local_scan_exclusive(__local int *tmp, const int value, int *total) {
+
+    const int lid = get_local_id(0);
+    const int size = get_local_size(0);
+
+    tmp[lid] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int offset = 1; offset < size; offset <<= 1) {
+        const int add = lid >= offset ? tmp[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tmp[lid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    const int inclusive = tmp[lid];
+    *total = tmp[size - 1];
+    barrier(CLK_LOCAL_MEM_FENCE); // tmp is reused by the next call
+    return inclusive - value;
+}
+
+#define DEFINE_RADIX_SORT(T, U, name) \
+__kernel void radix_count_##name(const int n, const int shift, __global const T *keys, __global int *counts, __local int *bins) { \
+\
+    const int lid = get_local_id(0); \
+    const int globalIndex = get_global_id(0); \
+\
+    for (int b = lid; b < RADIX_BUCKETS; b += get_local_size(0)) { \
+        bins[b] = 0; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    if (globalIndex < n) { \
+        atomic_inc(&bins[(radix_map_##name(keys[globalIndex]) >> shift) & (RADIX_BUCKETS - 1)]); \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    for (int b = lid; b < RADIX_BUCKETS; b += get_local_size(0)) { \
+        counts[b * get_num_groups(0) + get_group_id(0)] = bins[b]; \
+    } \
+} \
+\
+__kernel void radix_scatter_##name(const int n, const int shift, const int has_values, __global const T *keys_in, __global T *keys_out, __global const int *values_in, __global int *values_out, __global const int *offsets, __local U *local_keys, __local int *order, __local int *scan_tmp, __local int *digit_start) { \
+\
+    const int lid = get_local_id(0); \
+    const int base = get_group_id(0) * get_local_size(0); \
+\
+    /* Padding past n maps to all ones: the last digit, after every real key */ \
+    local_keys[lid] = base + lid < n ? radix_map_##name(keys_in[base + lid]) : (U)0 - 1; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+\
+    /* Stable split on each bit of the digit: zeros first, order kept */ \
+    int src = lid; \
+    for (int b = 0; b < RADIX_BITS; b++) { \
+        const int bit = (int)((local_keys[src] >> (shift + b)) & 1); \
+        int zeros; \
+        const int zeros_before = local_scan_exclusive(scan_tmp, !bit, &zeros); \
+        order[bit ? zeros + lid - zeros_before : zeros_before] = src; \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+        src = order[lid]; \
+        barrier(CLK_LOCAL_MEM_FENCE); \
+    } \
+\
+    /* Where each digit starts in the sorted tile gives every key its rank */ \
+    const int digit = (int)((local_keys[src] >> shift) & (RADIX_BUCKETS - 1)); \
+    scan_tmp[lid] = digit; \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+    if (lid == 0 || scan_tmp[lid - 1] != digit) { \
+        digit_start[digit] = lid; \
+    } \
+    barrier(CLK_LOCAL_MEM_FENCE); \
+\
+    if (base + src < n) { \
+        const int dest = offsets[digit * get_num_groups(0) + get_group_id(0)] + lid - digit_start[digit]; \
+        keys_out[dest] = keys_in[base + src]; \
+        if (has_values) { \
+            values_out[dest] = values_in[base + src]; \
+        } \
+    } \
+}
+
+DEFINE_RADIX_SORT(int, uint, int)
+DEFINE_RADIX_SORT(float, uint, float)
+DEFINE_RADIX_SORT(long, ulong, long)
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+ulong radix_map_double(const double x) {
+    const ulong u = as_ulong(x);
+    return u ^ ((u >> 63) ? 0xFFFFFFFFFFFFFFFFul : 0x8000000000000000ul);
+}
+DEFINE_RADIX_SORT(double, ulong, double)
+#endif
+
+// Stencils / convolutions of float data. Coefficients are applied as a
+// correlation, out[i] = sum over k of c[k + r] * in[i + k] for k in [-r, r], and
+// edges are clamped (the nearest element stands in for those outside). Each
+// work-group loads its tile plus an r-wide halo into local memory once, so
+// every input is read from global memory about once instead of 2r + 1 times.
+// The coefficients come from a __constant buffer, or are compiled in when the
+// program is built with -DCONV_RADIUS=r -DCONV_COEFFS=c0,c1,... (the radius
+// argument is then ignored and the loops have constant bounds).
+#ifdef CONV_COEFFS
+__constant float conv_compiled[] = {CONV_COEFFS};
+#define CONV_RADIUS_OF(radius) CONV_RADIUS
+#define CONV_COEFF(coeffs, i) conv_compiled[i]
+#else
+#define CONV_RADIUS_OF(radius) (radius)
+#define CONV_COEFF(coeffs, i) (coeffs)[i]
+#endif
+
+// 1D: coeffs holds 2r + 1 values, tile holds local size + 2r floats
+__kernel void conv1d_ocl(const int n, const int radius, __global const float *in, __global float *out, __constant float *coeffs, __local float *tile) {
+
+    const int r = CONV_RADIUS_OF(radius);
+    const int lid = get_local_id(0);
+    const int lsize = get_local_size(0);
+    const int base = get_group_id(0) * lsize - r;
+
+    for (int t = lid; t < lsize + 2 * r; t += lsize) {
+        tile[t] = in[min(max(base + t, 0), n - 1)];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int i = get_global_id(0);
+    if (i < n) {
+        float acc = 0.0f;
+        for (int k = 0; k <= 2 * r; k++) {
+            acc += CONV_COEFF(coeffs, k) * tile[lid + k];
+        }
+        out[i] = acc;
+    }
+}
+
+// 2D over a row-major rows x cols matrix: coeffs holds (2r + 1)^2 values row by
+// row, tile holds (local width + 2r) x (local height + 2r) floats
+__kernel void conv2d_ocl(const int rows, const int cols, const int radius, __global const float *in, __global float *out, __constant float *coeffs, __local float *tile) {
+
+    const int r = CONV_RADIUS_OF(radius);
+    const int lx = get_local_id(0), ly = get_local_id(1);
+    const int lw = get_local_size(0), lh = get_local_size(1);
+    const int tw = lw + 2 * r, th = lh + 2 * r;
+    const int x0 = get_group_id(0) * lw - r, y0 = get_group_id(1) * lh - r;
+
+    for (int ty = ly; ty < th; ty += lh) {
+        const int y = min(max(y0 + ty, 0), rows - 1);
+        for (int tx = lx; tx < tw; tx += lw) {
+            tile[ty * tw + tx] = in[(long)y * cols + min(max(x0 + tx, 0), cols - 1)];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    const int x = get_global_id(0), y = get_global_id(1);
+    if (x < cols && y < rows) {
+        float acc = 0.0f;
+        for (int dy = 0; dy <= 2 * r; dy++) {
+            for (int dx = 0; dx <= 2 * r; dx++) {
+                acc += CONV_COEFF(coeffs, dy * (2 * r + 1) + dx) * tile[(ly + dy) * tw + lx + dx];
+            }
+        }
+        out[(long)y * cols + x] = acc;
+    }
+}
+
+// STREAM-style bandwidth kernels (copy, scale, add, triad) over float arrays,
+// the attainable-bandwidth ceiling the other kernels are measured against
+__kernel void stream_copy(const int n, __global const float *a, __global float *c) {
+
+    const int i = get_global_id(0);
+    if (i < n) {
+        c[i] = a[i];
+    }
+}
+
+__kernel void stream_scale(const int n, const float s, __global float *b, __global const float *c) {
+
+    const int i = get_global_id(0);
+    if (i < n) {
+        b[i] = s * c[i];
+    }
+}
+
+__kernel void stream_add(const int n, __global const float *a, __global const float *b, __global float *c) {
+
+    const int i = get_global_id(0);
+    if (i < n) {
+        c[i] = a[i] + b[i];
+    }
+}
+
+__kernel void stream_triad(const int n, const float s, __global float *a, __global const float *b, __global const float *c) {
+
+    const int i = get_global_id(0);
+    if (i < n) {
+        a[i] = b[i] + s * c[i];
+    }
+}
+
+// Compute ceiling: PEAK_CHAINS independent multiply-add chains of PEAK_STEPS
+// steps each (contracted to FMAs), 2 * PEAK_CHAINS * PEAK_STEPS flops per
+// work item and a single store
+#define PEAK_CHAINS 8
+#define PEAK_STEPS 64
+__kernel void peak_flops(const int n, const float s, __global float *out) {
+
+    const int i = get_global_id(0);
+    float x[PEAK_CHAINS];
+    for (int c = 0; c < PEAK_CHAINS; c++) {
+        x[c] = (float)(i + c);
+    }
+    for (int k = 0; k < PEAK_STEPS; k++) {
+        #pragma unroll
+        for (int c = 0; c < PEAK_CHAINS; c++) {
+            x[c] = x[c] * s + 0.5f;
+        }
+    }
+    float sum = 0.0f;
+    for (int c = 0; c < PEAK_CHAINS; c++) {
+        sum += x[c];
+    }
+    if (i < n) {
+        out[i] = sum;
+    }
+}
+
+// Does nothing: the launch-overhead microbenchmarks time the enqueue and the
+// completion, not the work
+__kernel void empty_ocl(const int n) {
+}